@@ -1,9 +1,445 @@
 #include <gtkmm.h>
 #include <cairomm/context.h>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <climits>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
 #include <iomanip>
 #include <iostream>
+#include <mutex>
+#include <thread>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+
+// Runs fn(begin, end) over [0, count) split into one band per hardware thread
+template <typename Fn>
+void parallel_for_bands(int count, Fn fn) {
+    int n_threads = std::max(1u, std::thread::hardware_concurrency());
+    n_threads = std::min(n_threads, std::max(1, count));
+    if (n_threads == 1) {
+        fn(0, count);
+        return;
+    }
+
+    std::vector<std::thread> workers;
+    for (int t = 0; t < n_threads; t++) {
+        int begin = static_cast<int>((int64_t)count * t / n_threads);
+        int end = static_cast<int>((int64_t)count * (t + 1) / n_threads);
+        workers.emplace_back(fn, begin, end);
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
+
+
+// A run of pixels [x0, x1) on row y
+struct Span {
+    int y;
+    int x0;
+    int x1;
+};
+
+// Statistics for the RGB channels of a region
+struct RegionStats {
+    uint64_t pixel_count = 0;
+    std::array<std::array<uint64_t, 256>, 3> histogram{};
+    std::array<double, 3> mean{};
+    std::array<int, 3> min{{255, 255, 255}};
+    std::array<int, 3> max{{0, 0, 0}};
+    size_t unique_colors = 0;
+};
+
+
+// Per-channel min/max over n interleaved 8-bit pixels; mn/mx hold one entry per channel
+static void span_min_max(const guint8* p, int n, int channels, guint8* mn, guint8* mx) {
+    int total = n * channels;
+    int i = 0;
+
+#if defined(__SSE2__)
+    // 48 bytes is a whole number of pixels for 3 and 4 channels, so each byte
+    // lane of the three accumulators always holds the same channel
+    if (total >= 48) {
+        __m128i vmin[3], vmax[3];
+        for (int k = 0; k < 3; k++) {
+            vmin[k] = _mm_set1_epi8(static_cast<char>(0xFF));
+            vmax[k] = _mm_setzero_si128();
+        }
+        for (; i + 48 <= total; i += 48) {
+            for (int k = 0; k < 3; k++) {
+                __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i + 16 * k));
+                vmin[k] = _mm_min_epu8(vmin[k], v);
+                vmax[k] = _mm_max_epu8(vmax[k], v);
+            }
+        }
+
+        alignas(16) guint8 lo[48], hi[48];
+        for (int k = 0; k < 3; k++) {
+            _mm_store_si128(reinterpret_cast<__m128i*>(lo + 16 * k), vmin[k]);
+            _mm_store_si128(reinterpret_cast<__m128i*>(hi + 16 * k), vmax[k]);
+        }
+        for (int b = 0; b < 48; b++) {
+            int c = b % channels;
+            mn[c] = std::min(mn[c], lo[b]);
+            mx[c] = std::max(mx[c], hi[b]);
+        }
+    }
+#endif
+
+    // Remaining pixels (or all of them without SSE2)
+    for (; i < total; i++) {
+        int c = i % channels;
+        mn[c] = std::min(mn[c], p[i]);
+        mx[c] = std::max(mx[c], p[i]);
+    }
+}
+
+
+/**
+ * Computes histogram, mean, min/max and unique color count over a set of spans.
+ * Rows are split into bands that are processed on separate threads and merged.
+ */
+static RegionStats compute_region_stats(const Glib::RefPtr<Gdk::Pixbuf>& pixbuf,
+                                        const std::vector<Span>& spans) {
+    struct Partial {
+        std::array<std::array<uint64_t, 256>, 3> histogram{};
+        guint8 min[4] = {255, 255, 255, 255};
+        guint8 max[4] = {0, 0, 0, 0};
+        std::vector<uint64_t> seen;  // One bit per 24-bit color
+    };
+
+    const guint8* pixels = pixbuf->get_pixels();
+    int channels = pixbuf->get_n_channels();
+    int rowstride = pixbuf->get_rowstride();
+
+    int n_threads = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<Partial> partials(n_threads);
+    std::atomic<int> next_partial{0};
+
+    parallel_for_bands(static_cast<int>(spans.size()), [&](int begin, int end) {
+        Partial& part = partials[next_partial++];
+        part.seen.assign((1 << 24) / 64, 0);
+
+        for (int s = begin; s < end; s++) {
+            const Span& span = spans[s];
+            if (span.x1 <= span.x0) continue;
+
+            const guint8* row = pixels + (size_t)span.y * rowstride + (size_t)span.x0 * channels;
+            int n = span.x1 - span.x0;
+            span_min_max(row, n, channels, part.min, part.max);
+
+            for (int i = 0; i < n; i++) {
+                const guint8* px = row + i * channels;
+                part.histogram[0][px[0]]++;
+                part.histogram[1][px[1]]++;
+                part.histogram[2][px[2]]++;
+
+                uint32_t key = (uint32_t(px[0]) << 16) | (uint32_t(px[1]) << 8) | px[2];
+                part.seen[key >> 6] |= uint64_t(1) << (key & 63);
+            }
+        }
+    });
+
+    // Merging the per-band results
+    RegionStats stats;
+    int used = next_partial.load();
+    for (int t = 0; t < used; t++) {
+        for (int c = 0; c < 3; c++) {
+            for (int v = 0; v < 256; v++) {
+                stats.histogram[c][v] += partials[t].histogram[c][v];
+            }
+            stats.min[c] = std::min<int>(stats.min[c], partials[t].min[c]);
+            stats.max[c] = std::max<int>(stats.max[c], partials[t].max[c]);
+        }
+    }
+    for (size_t w = 0; used > 0 && w < partials[0].seen.size(); w++) {
+        uint64_t bits = 0;
+        for (int t = 0; t < used; t++) {
+            bits |= partials[t].seen[w];
+        }
+        stats.unique_colors += __builtin_popcountll(bits);
+    }
+
+    for (int v = 0; v < 256; v++) {
+        stats.pixel_count += stats.histogram[0][v];
+    }
+    if (stats.pixel_count > 0) {
+        for (int c = 0; c < 3; c++) {
+            uint64_t sum = 0;
+            for (int v = 0; v < 256; v++) {
+                sum += stats.histogram[c][v] * v;
+            }
+            stats.mean[c] = (double)sum / stats.pixel_count;
+        }
+    }
+    return stats;
+}
+
+
+// Spans covering the rectangle [x0, x1) x [y0, y1)
+static std::vector<Span> rectangle_spans(int x0, int y0, int x1, int y1) {
+    std::vector<Span> spans;
+    for (int y = y0; y < y1; y++) {
+        spans.push_back({y, x0, x1});
+    }
+    return spans;
+}
+
+// Spans inside a closed polygon (even-odd rule), sampled at pixel centers
+static std::vector<Span> polygon_spans(const std::vector<std::pair<double, double>>& points,
+                                       int width, int height) {
+    std::vector<Span> spans;
+    if (points.size() < 3) return spans;
+
+    double min_y = points[0].second, max_y = points[0].second;
+    for (const auto& p : points) {
+        min_y = std::min(min_y, p.second);
+        max_y = std::max(max_y, p.second);
+    }
+    int y_begin = std::max(0, static_cast<int>(std::floor(min_y)));
+    int y_end = std::min(height, static_cast<int>(std::ceil(max_y)) + 1);
+
+    std::vector<double> crossings;
+    for (int y = y_begin; y < y_end; y++) {
+        double sample_y = y + 0.5;
+        crossings.clear();
+        for (size_t i = 0; i < points.size(); i++) {
+            const auto& a = points[i];
+            const auto& b = points[(i + 1) % points.size()];
+            if ((a.second <= sample_y) != (b.second <= sample_y)) {
+                double t = (sample_y - a.second) / (b.second - a.second);
+                crossings.push_back(a.first + t * (b.first - a.first));
+            }
+        }
+        std::sort(crossings.begin(), crossings.end());
+
+        for (size_t i = 0; i + 1 < crossings.size(); i += 2) {
+            int x0 = std::max(0, static_cast<int>(std::ceil(crossings[i] - 0.5)));
+            int x1 = std::min(width, static_cast<int>(std::ceil(crossings[i + 1] - 0.5)));
+            if (x1 > x0) {
+                spans.push_back({y, x0, x1});
+            }
+        }
+    }
+    return spans;
+}
+
+
+/**
+ * On-disk cache of decoded images. Each entry is a small header followed by
+ * the raw pixbuf rows, so a later load just memory-maps the file and wraps it
+ * in a pixbuf without decoding or copying. There is one entry per image path,
+ * checked against the file's size and modification time, so a changed file
+ * replaces its old entry. The least recently used entries are deleted once
+ * the cache grows past MAX_BYTES.
+ */
+class RawImageCache {
+public:
+    // Fills out with rows [y0, y1), each packed at width * channels bytes
+    typedef std::function<void(int, int, guint8*)> RowReader;
+
+    static constexpr uint64_t MAX_BYTES = 4ull * 1024 * 1024 * 1024;
+    static constexpr int STORE_ROWS = 64;  // Rows written between cancellation checks
+
+private:
+    struct Header {
+        char magic[8];
+        uint64_t file_size;
+        int64_t mtime;
+        int32_t width;
+        int32_t height;
+        int32_t rowstride;
+        int32_t n_channels;
+        int32_t has_alpha;
+        int32_t reserved[5];
+    };
+    static_assert(sizeof(Header) == 64, "Header keeps the pixel data 64-byte aligned");
+
+    static constexpr char MAGIC[8] = {'R', 'A', 'W', 'P', 'I', 'X', '0', '1'};
+
+    static std::string cache_dir() {
+        return Glib::build_filename(Glib::get_user_cache_dir(), "raw-image-cache");
+    }
+
+    static bool file_key(const std::string& path, std::string& entry, uint64_t& size, int64_t& mtime) {
+        std::error_code ec;
+        auto absolute = std::filesystem::absolute(path, ec);
+        if (ec) return false;
+        size = std::filesystem::file_size(absolute, ec);
+        if (ec) return false;
+        auto time = std::filesystem::last_write_time(absolute, ec);
+        if (ec) return false;
+        mtime = time.time_since_epoch().count();
+
+        std::stringstream name;
+        name << std::hex << std::hash<std::string>{}(absolute.string()) << ".raw";
+        entry = Glib::build_filename(cache_dir(), name.str());
+        return true;
+    }
+
+    // Bytes of pixel data; the last row of a pixbuf is not padded to the rowstride
+    static size_t pixel_bytes(int width, int height, int rowstride, int n_channels) {
+        return (size_t)rowstride * (height - 1) + (size_t)width * n_channels;
+    }
+
+    // Deletes the least recently used entries other than keep until the cache fits MAX_BYTES
+    static void trim(const std::string& keep) {
+        struct Entry {
+            std::filesystem::file_time_type time;
+            std::filesystem::path path;
+            uint64_t size;
+        };
+        std::vector<Entry> entries;
+        uint64_t total = 0;
+        std::error_code ec;
+        for (const auto& file : std::filesystem::directory_iterator(cache_dir(), ec)) {
+            if (file.path().extension() != ".raw") continue;
+            Entry entry{file.last_write_time(ec), file.path(), file.file_size(ec)};
+            if (ec) continue;
+            total += entry.size;
+            if (entry.path != keep) entries.push_back(entry);
+        }
+
+        std::sort(entries.begin(), entries.end(),
+                  [](const Entry& a, const Entry& b) { return a.time < b.time; });
+        for (const auto& entry : entries) {
+            if (total <= MAX_BYTES) break;
+            if (std::filesystem::remove(entry.path, ec)) total -= entry.size;
+        }
+    }
+
+public:
+    /**
+     * Returns the cached pixbuf for path, or nullptr on a miss. With writable
+     * set the mapping is private, so edits to the pixbuf never reach the file.
+     */
+    static Glib::RefPtr<Gdk::Pixbuf> load(const std::string& path, bool writable) {
+        std::string entry;
+        uint64_t size;
+        int64_t mtime;
+        if (!file_key(path, entry, size, mtime)) return {};
+
+        GMappedFile* mapped = g_mapped_file_new(entry.c_str(), writable, nullptr);
+        if (!mapped) return {};
+
+        gsize length = g_mapped_file_get_length(mapped);
+        const guint8* data = reinterpret_cast<const guint8*>(g_mapped_file_get_contents(mapped));
+        Header header;
+        bool valid = length >= sizeof(Header);
+        if (valid) {
+            memcpy(&header, data, sizeof(Header));
+            valid = memcmp(header.magic, MAGIC, sizeof(MAGIC)) == 0
+                && header.file_size == size && header.mtime == mtime
+                && header.width > 0 && header.height > 0
+                && (header.n_channels == 3 || header.n_channels == 4)
+                && header.has_alpha == (header.n_channels == 4)
+                && header.rowstride >= header.width * header.n_channels
+                && length >= sizeof(Header) + pixel_bytes(header.width, header.height,
+                                                          header.rowstride, header.n_channels);
+        }
+        if (!valid) {
+            g_mapped_file_unref(mapped);
+            return {};
+        }
+
+        // Marks the entry as recently used for trim()
+        std::error_code ec;
+        std::filesystem::last_write_time(entry, std::filesystem::file_time_type::clock::now(), ec);
+
+        // The mapping stays alive for as long as the pixbuf does
+        return Gdk::Pixbuf::create_from_data(
+            data + sizeof(Header), Gdk::Colorspace::RGB, header.has_alpha != 0, 8,
+            header.width, header.height, header.rowstride,
+            [mapped](const guint8*) { g_mapped_file_unref(mapped); });
+    }
+
+    /**
+     * Writes a decoded image to the cache (best effort; failures are ignored).
+     * Rows come from read if given, else straight from pixbuf. The entry is
+     * abandoned as soon as cancelled() returns true, checked every STORE_ROWS
+     * rows.
+     */
+    static void store(const std::string& path, const Glib::RefPtr<Gdk::Pixbuf>& pixbuf,
+                      const std::function<bool()>& cancelled, const RowReader& read = nullptr) {
+        if (!pixbuf || pixbuf->get_bits_per_sample() != 8) return;
+
+        std::string entry;
+        Header header{};
+        if (!file_key(path, entry, header.file_size, header.mtime)) return;
+
+        std::error_code ec;
+        std::filesystem::create_directories(cache_dir(), ec);
+        if (ec) return;
+
+        memcpy(header.magic, MAGIC, sizeof(MAGIC));
+        header.width = pixbuf->get_width();
+        header.height = pixbuf->get_height();
+        header.rowstride = pixbuf->get_rowstride();
+        header.n_channels = pixbuf->get_n_channels();
+        header.has_alpha = pixbuf->get_has_alpha() ? 1 : 0;
+
+        // Written under a temporary name so a partial file is never picked up
+        std::string temp = entry + ".tmp";
+        {
+            std::ofstream out(temp, std::ios::binary);
+            out.write(reinterpret_cast<const char*>(&header), sizeof(Header));
+
+            // Rows keep the pixbuf's padding so the mapped file can be wrapped as is
+            size_t row_bytes = (size_t)header.width * header.n_channels;
+            std::vector<guint8> rows((size_t)STORE_ROWS * header.rowstride);
+            std::vector<guint8> packed(read ? STORE_ROWS * row_bytes : 0);
+            for (int y0 = 0; y0 < header.height && out; y0 += STORE_ROWS) {
+                if (cancelled()) {
+                    out.setstate(std::ios::failbit);
+                    break;
+                }
+                int y1 = std::min(header.height, y0 + STORE_ROWS);
+                if (read) {
+                    read(y0, y1, packed.data());
+                    for (int y = y0; y < y1; y++) {
+                        memcpy(&rows[(size_t)(y - y0) * header.rowstride], &packed[(y - y0) * row_bytes], row_bytes);
+                    }
+                } else {
+                    const guint8* src = pixbuf->get_pixels() + (size_t)y0 * header.rowstride;
+                    memcpy(rows.data(), src, (size_t)(y1 - y0 - 1) * header.rowstride + row_bytes);
+                }
+                size_t bytes = y1 == header.height ? (size_t)(y1 - y0 - 1) * header.rowstride + row_bytes
+                                                   : (size_t)(y1 - y0) * header.rowstride;
+                out.write(reinterpret_cast<const char*>(rows.data()), bytes);
+            }
+            if (!out) {
+                out.close();
+                std::filesystem::remove(temp, ec);
+                return;
+            }
+        }
+        std::filesystem::rename(temp, entry, ec);
+        if (ec) {
+            std::filesystem::remove(temp, ec);
+            return;
+        }
+        trim(entry);
+    }
+};
+
 
 class PixelViewer : public Gtk::Window {
+protected:
+    enum class RegionMode {
+        Pixel,
+        Rectangle,
+        Lasso
+    };
+
 private:
     Gtk::Box m_vbox{Gtk::Orientation::VERTICAL};
     Gtk::DrawingArea m_image_area;
@@ -14,11 +450,49 @@ private:
     Gtk::Box m_coord_box;
     Gtk::Button m_get_color_btn;
     Gtk::Button m_load_btn;
+
+    // Region statistics widgets
+    Gtk::Box m_region_box{Gtk::Orientation::HORIZONTAL};
+    Gtk::Button m_pixel_mode_btn;
+    Gtk::Button m_rect_mode_btn;
+    Gtk::Button m_lasso_mode_btn;
+    Gtk::Label m_region_info;
+    Gtk::DrawingArea m_histogram_area;
     
     Glib::RefPtr<Gdk::Pixbuf> m_pixbuf;
     std::optional<Gdk::RGBA> m_current_color;
     Glib::RefPtr<Gtk::GestureClick> m_click_controller;
     std::unique_ptr<Gtk::FileChooserDialog> m_active_dialog;
+
+    // Region selection and statistics
+    RegionMode m_region_mode = RegionMode::Pixel;
+    Glib::RefPtr<Gtk::GestureDrag> m_drag_controller;
+    double m_drag_start_x = 0;
+    double m_drag_start_y = 0;
+    std::vector<std::pair<double, double>> m_region_points;  // Image coordinates
+    std::optional<RegionStats> m_region_stats;
+
+    // Background image loading
+    static const size_t LOAD_CHUNK_SIZE = 256 * 1024;  // Bytes fed to the loader per step
+    std::thread m_load_thread;
+    std::atomic<unsigned> m_load_generation{0};  // Bumped to cancel the running load
+    Glib::Dispatcher m_load_dispatcher;          // Wakes the UI thread when the loader made progress
+    std::mutex m_load_mutex;                     // Guards the fields below
+    Glib::RefPtr<Gdk::Pixbuf> m_loaded_pixbuf;
+    unsigned m_loaded_generation = 0;
+    bool m_load_done = false;
+    std::string m_load_error;
+    int m_loaded_rows_y0 = INT_MAX;  // Rows decoded since the UI last looked
+    int m_loaded_rows_y1 = 0;
+
+    // Copy of m_pixbuf scaled to the widget, rebuilt on resize and patched after changes
+    Glib::RefPtr<Gdk::Pixbuf> m_display_pixbuf;
+    Glib::RefPtr<Gdk::Pixbuf> m_display_source;  // The pixbuf m_display_pixbuf was made from
+    bool m_display_dirty = false;
+    int m_dirty_x0 = 0;  // Changed image area not yet reflected in m_display_pixbuf
+    int m_dirty_y0 = 0;
+    int m_dirty_x1 = 0;
+    int m_dirty_y1 = 0;
 public:
     PixelViewer() {
         set_title("Pixel Viewer");
@@ -47,6 +521,22 @@ public:
         m_coord_box.append(m_get_color_btn);
         m_vbox.append(m_coord_box);
 
+        // Region mode selection
+        m_region_box.set_margin(5);
+        m_pixel_mode_btn.set_label("Pixel");
+        m_pixel_mode_btn.signal_clicked().connect(
+            sigc::bind(sigc::mem_fun(*this, &PixelViewer::set_region_mode), RegionMode::Pixel));
+        m_region_box.append(m_pixel_mode_btn);
+        m_rect_mode_btn.set_label("Rectangle");
+        m_rect_mode_btn.signal_clicked().connect(
+            sigc::bind(sigc::mem_fun(*this, &PixelViewer::set_region_mode), RegionMode::Rectangle));
+        m_region_box.append(m_rect_mode_btn);
+        m_lasso_mode_btn.set_label("Lasso");
+        m_lasso_mode_btn.signal_clicked().connect(
+            sigc::bind(sigc::mem_fun(*this, &PixelViewer::set_region_mode), RegionMode::Lasso));
+        m_region_box.append(m_lasso_mode_btn);
+        m_vbox.append(m_region_box);
+
         // Color display area
         m_color_display.set_content_width(100);
         m_color_display.set_content_height(100);
@@ -57,6 +547,14 @@ public:
         m_color_info.set_margin(5);
         m_vbox.append(m_color_info);
 
+        // Region statistics and histogram
+        m_region_info.set_margin(5);
+        m_vbox.append(m_region_info);
+        m_histogram_area.set_content_width(256);
+        m_histogram_area.set_content_height(80);
+        m_histogram_area.set_draw_func(sigc::mem_fun(*this, &PixelViewer::on_draw_histogram));
+        m_vbox.append(m_histogram_area);
+
         // Load image button
         m_load_btn.set_label("Load Image");
         m_load_btn.signal_clicked().connect(
@@ -68,6 +566,31 @@ public:
         m_click_controller->signal_pressed().connect(
             sigc::mem_fun(*this, &PixelViewer::on_image_clicked));
         m_image_area.add_controller(m_click_controller);
+
+        // Setup region dragging
+        m_drag_controller = Gtk::GestureDrag::create();
+        m_drag_controller->signal_drag_begin().connect(
+            sigc::mem_fun(*this, &PixelViewer::on_region_drag_begin));
+        m_drag_controller->signal_drag_update().connect(
+            sigc::mem_fun(*this, &PixelViewer::on_region_drag_update));
+        m_drag_controller->signal_drag_end().connect(
+            sigc::mem_fun(*this, &PixelViewer::on_region_drag_end));
+        m_image_area.add_controller(m_drag_controller);
+
+        // CSS for the active region mode
+        auto css_provider = Gtk::CssProvider::create();
+        css_provider->load_from_data("button.active-tool { background: #ffd700; }");
+        for (auto* button : {&m_pixel_mode_btn, &m_rect_mode_btn, &m_lasso_mode_btn}) {
+            button->get_style_context()->add_provider(css_provider, GTK_STYLE_PROVIDER_PRIORITY_APPLICATION);
+        }
+        m_pixel_mode_btn.add_css_class("active-tool");
+
+        // Progress from the loader thread is handled on the UI thread
+        m_load_dispatcher.connect(sigc::mem_fun(*this, &PixelViewer::on_load_progress));
+    }
+
+    ~PixelViewer() override {
+        cancel_load();
     }
 
 protected:
@@ -79,9 +602,94 @@ protected:
                 (double)height / m_pixbuf->get_height()
             );
             
-            cr->scale(scale, scale);
-            Gdk::Cairo::set_source_pixbuf(cr, m_pixbuf, 0, 0);
+            // Painting the cached display copy instead of resampling the full image
+            update_display_cache(width, height);
+            Gdk::Cairo::set_source_pixbuf(cr, m_display_pixbuf, 0, 0);
             cr->paint();
+
+            // Outline of the selected region
+            if (m_region_points.size() >= 2) {
+                cr->set_source_rgb(1.0, 0.0, 0.0);
+                cr->set_line_width(1.0);
+                cr->move_to(m_region_points[0].first * scale, m_region_points[0].second * scale);
+                for (size_t i = 1; i < m_region_points.size(); i++) {
+                    cr->line_to(m_region_points[i].first * scale, m_region_points[i].second * scale);
+                }
+                cr->close_path();
+                cr->stroke();
+            }
+        }
+    }
+
+    // Marks an image area (image coordinates) as changed since the last draw
+    void invalidate_display(int x, int y, int w, int h) {
+        if (!m_display_dirty) {
+            m_dirty_x0 = x;
+            m_dirty_y0 = y;
+            m_dirty_x1 = x + w;
+            m_dirty_y1 = y + h;
+            m_display_dirty = true;
+        } else {
+            m_dirty_x0 = std::min(m_dirty_x0, x);
+            m_dirty_y0 = std::min(m_dirty_y0, y);
+            m_dirty_x1 = std::max(m_dirty_x1, x + w);
+            m_dirty_y1 = std::max(m_dirty_y1, y + h);
+        }
+    }
+
+    // Brings m_display_pixbuf up to date for a widget of the given size
+    void update_display_cache(int width, int height) {
+        double scale = std::min(
+            (double)width / m_pixbuf->get_width(),
+            (double)height / m_pixbuf->get_height()
+        );
+        int display_w = std::max(1, static_cast<int>(m_pixbuf->get_width() * scale));
+        int display_h = std::max(1, static_cast<int>(m_pixbuf->get_height() * scale));
+
+        // New image or new size: rescale everything
+        if (!m_display_pixbuf || m_display_source != m_pixbuf ||
+            m_display_pixbuf->get_width() != display_w || m_display_pixbuf->get_height() != display_h) {
+            m_display_pixbuf = m_pixbuf->scale_simple(display_w, display_h, Gdk::InterpType::BILINEAR);
+            m_display_source = m_pixbuf;
+            m_display_dirty = false;
+            return;
+        }
+
+        if (!m_display_dirty) return;
+        m_display_dirty = false;
+
+        // Rescale only the changed area, padded by a pixel for the filter footprint
+        double scale_x = (double)display_w / m_pixbuf->get_width();
+        double scale_y = (double)display_h / m_pixbuf->get_height();
+        int x0 = std::max(0, static_cast<int>(std::floor(m_dirty_x0 * scale_x)) - 1);
+        int y0 = std::max(0, static_cast<int>(std::floor(m_dirty_y0 * scale_y)) - 1);
+        int x1 = std::min(display_w, static_cast<int>(std::ceil(m_dirty_x1 * scale_x)) + 1);
+        int y1 = std::min(display_h, static_cast<int>(std::ceil(m_dirty_y1 * scale_y)) + 1);
+        if (x1 > x0 && y1 > y0) {
+            m_pixbuf->scale(m_display_pixbuf, x0, y0, x1 - x0, y1 - y0,
+                            0, 0, scale_x, scale_y, Gdk::InterpType::BILINEAR);
+        }
+    }
+
+    void on_draw_histogram(const Cairo::RefPtr<Cairo::Context>& cr, int width, int height) {
+        if (!m_region_stats.has_value()) return;
+
+        uint64_t peak = 1;
+        for (const auto& channel : m_region_stats->histogram) {
+            peak = std::max(peak, *std::max_element(channel.begin(), channel.end()));
+        }
+
+        const double colors[3][3] = {{1, 0, 0}, {0, 0.7, 0}, {0, 0, 1}};
+        cr->set_line_width(1.0);
+        for (int c = 0; c < 3; c++) {
+            cr->set_source_rgb(colors[c][0], colors[c][1], colors[c][2]);
+            for (int v = 0; v < 256; v++) {
+                double x = (v + 0.5) * width / 256.0;
+                double y = height - (double)m_region_stats->histogram[c][v] / peak * height;
+                if (v == 0) cr->move_to(x, y);
+                else cr->line_to(x, y);
+            }
+            cr->stroke();
         }
     }
 
@@ -130,8 +738,7 @@ protected:
                 auto file = m_active_dialog->get_file();
                 if (file) {
                     std::cout << "Loading file: " << file->get_path() << std::endl;
-                    m_pixbuf = Gdk::Pixbuf::create_from_file(file->get_path());
-                    m_image_area.queue_draw();
+                    start_load(file->get_path());
                 }
             } catch (const Glib::Error& ex) {
                 std::cerr << "Error loading image: " << ex.what() << std::endl;
@@ -141,6 +748,232 @@ protected:
         m_active_dialog->hide();
     }
 
+    // Stops the loader thread (if any) and waits for it to exit
+    void cancel_load() {
+        ++m_load_generation;
+        if (m_load_thread.joinable()) {
+            m_load_thread.join();
+        }
+    }
+
+    // Starts decoding the file on a worker thread, replacing any load in flight
+    void start_load(const std::string& path) {
+        cancel_load();
+
+        unsigned generation = m_load_generation.load();
+        m_load_thread = std::thread([this, path, generation]() {
+            load_worker(path, generation);
+        });
+    }
+
+    // Runs on the loader thread: feeds the file to a PixbufLoader in chunks so
+    // the rows decoded so far can be shown while the rest is still loading
+    void load_worker(const std::string& path, unsigned generation) {
+        // Previously decoded images are mapped straight from the cache
+        auto cached = RawImageCache::load(path, false);
+        if (cached) {
+            post_load_result(generation, cached, true, "");
+            return;
+        }
+
+        std::ifstream infile(path, std::ios::binary);
+        if (!infile) {
+            post_load_result(generation, nullptr, true, "Could not open " + path);
+            return;
+        }
+
+        auto loader = Gdk::PixbufLoader::create();
+        std::vector<char> chunk(LOAD_CHUNK_SIZE);
+
+        // Remember which rows were decoded so only those get rescaled for display
+        loader->signal_area_updated().connect([this](int x, int y, int w, int h) {
+            std::lock_guard<std::mutex> lock(m_load_mutex);
+            m_loaded_rows_y0 = std::min(m_loaded_rows_y0, y);
+            m_loaded_rows_y1 = std::max(m_loaded_rows_y1, y + h);
+        });
+
+        try {
+            while (infile) {
+                if (generation != m_load_generation.load()) {
+                    // A newer load was requested; drop this one
+                    try { loader->close(); } catch (const Glib::Error&) {}
+                    return;
+                }
+
+                infile.read(chunk.data(), chunk.size());
+                std::streamsize count = infile.gcount();
+                if (count <= 0) break;
+
+                loader->write(reinterpret_cast<const guint8*>(chunk.data()), count);
+
+                // The pixbuf exists once the header is parsed and fills in as rows arrive
+                auto pixbuf = loader->get_pixbuf();
+                if (pixbuf) {
+                    post_load_result(generation, pixbuf, false, "");
+                }
+            }
+
+            loader->close();
+            post_load_result(generation, loader->get_pixbuf(), true, "");
+        } catch (const Glib::Error& ex) {
+            post_load_result(generation, nullptr, true, ex.what());
+            return;
+        }
+
+        // Cached after the image is shown; a newer load stops the write
+        RawImageCache::store(path, loader->get_pixbuf(), [this, generation]() {
+            return generation != m_load_generation.load();
+        });
+    }
+
+    // Hands the loader state to the UI thread
+    void post_load_result(unsigned generation, const Glib::RefPtr<Gdk::Pixbuf>& pixbuf,
+                          bool done, const std::string& error) {
+        {
+            std::lock_guard<std::mutex> lock(m_load_mutex);
+            m_loaded_pixbuf = pixbuf;
+            m_loaded_generation = generation;
+            m_load_done = done;
+            m_load_error = error;
+        }
+        m_load_dispatcher.emit();
+    }
+
+    // Runs on the UI thread whenever the loader thread posts progress
+    void on_load_progress() {
+        Glib::RefPtr<Gdk::Pixbuf> pixbuf;
+        bool done;
+        std::string error;
+        int rows_y0, rows_y1;
+        {
+            std::lock_guard<std::mutex> lock(m_load_mutex);
+            if (m_loaded_generation != m_load_generation.load()) return;  // Stale update
+            pixbuf = m_loaded_pixbuf;
+            done = m_load_done;
+            error = m_load_error;
+            rows_y0 = m_loaded_rows_y0;
+            rows_y1 = m_loaded_rows_y1;
+            m_loaded_rows_y0 = INT_MAX;
+            m_loaded_rows_y1 = 0;
+        }
+
+        if (!error.empty()) {
+            std::cerr << "Error loading image: " << error << std::endl;
+            return;
+        }
+
+        if (pixbuf) {
+            if (pixbuf == m_pixbuf) {
+                if (rows_y1 > rows_y0) {
+                    invalidate_display(0, rows_y0, m_pixbuf->get_width(), rows_y1 - rows_y0);
+                }
+            } else {
+                // Region data belongs to the previous image
+                m_region_points.clear();
+                m_region_stats.reset();
+                m_region_info.set_text("");
+                m_histogram_area.queue_draw();
+            }
+            m_pixbuf = pixbuf;
+            m_image_area.queue_draw();
+        }
+        if (done) {
+            std::cout << "Image loaded" << std::endl;
+        }
+    }
+
+    void set_region_mode(RegionMode mode) {
+        m_region_mode = mode;
+
+        m_pixel_mode_btn.remove_css_class("active-tool");
+        m_rect_mode_btn.remove_css_class("active-tool");
+        m_lasso_mode_btn.remove_css_class("active-tool");
+        if (mode == RegionMode::Pixel) m_pixel_mode_btn.add_css_class("active-tool");
+        if (mode == RegionMode::Rectangle) m_rect_mode_btn.add_css_class("active-tool");
+        if (mode == RegionMode::Lasso) m_lasso_mode_btn.add_css_class("active-tool");
+    }
+
+    // Scale from image to widget coordinates
+    double display_scale() const {
+        return std::min(
+            (double)m_image_area.get_width() / m_pixbuf->get_width(),
+            (double)m_image_area.get_height() / m_pixbuf->get_height()
+        );
+    }
+
+    void on_region_drag_begin(double x, double y) {
+        if (!m_pixbuf || m_region_mode == RegionMode::Pixel) return;
+
+        double scale = display_scale();
+        m_drag_start_x = x;
+        m_drag_start_y = y;
+        m_region_points.clear();
+        m_region_points.push_back({x / scale, y / scale});
+        m_image_area.queue_draw();
+    }
+
+    void on_region_drag_update(double offset_x, double offset_y) {
+        if (!m_pixbuf || m_region_mode == RegionMode::Pixel || m_region_points.empty()) return;
+
+        double scale = display_scale();
+        double x = (m_drag_start_x + offset_x) / scale;
+        double y = (m_drag_start_y + offset_y) / scale;
+
+        if (m_region_mode == RegionMode::Rectangle) {
+            double x0 = m_region_points[0].first;
+            double y0 = m_region_points[0].second;
+            m_region_points = {{x0, y0}, {x, y0}, {x, y}, {x0, y}};
+        } else {
+            m_region_points.push_back({x, y});
+        }
+        m_image_area.queue_draw();
+    }
+
+    void on_region_drag_end(double offset_x, double offset_y) {
+        if (!m_pixbuf || m_region_mode == RegionMode::Pixel || m_region_points.empty()) return;
+
+        on_region_drag_update(offset_x, offset_y);
+        if (m_region_mode == RegionMode::Rectangle) {
+            query_rectangle();
+        } else {
+            query_lasso();
+        }
+    }
+
+    void query_rectangle() {
+        int width = m_pixbuf->get_width();
+        int height = m_pixbuf->get_height();
+        int x0 = std::clamp((int)std::floor(std::min(m_region_points[0].first, m_region_points[2].first)), 0, width);
+        int y0 = std::clamp((int)std::floor(std::min(m_region_points[0].second, m_region_points[2].second)), 0, height);
+        int x1 = std::clamp((int)std::ceil(std::max(m_region_points[0].first, m_region_points[2].first)), 0, width);
+        int y1 = std::clamp((int)std::ceil(std::max(m_region_points[0].second, m_region_points[2].second)), 0, height);
+        if (x1 <= x0 || y1 <= y0) return;
+
+        show_region_stats(compute_region_stats(m_pixbuf, rectangle_spans(x0, y0, x1, y1)),
+                          std::to_string(x1 - x0) + "x" + std::to_string(y1 - y0));
+    }
+
+    void query_lasso() {
+        auto spans = polygon_spans(m_region_points, m_pixbuf->get_width(), m_pixbuf->get_height());
+        if (spans.empty()) return;
+
+        show_region_stats(compute_region_stats(m_pixbuf, spans), "Lasso");
+    }
+
+    void show_region_stats(const RegionStats& stats, const std::string& name) {
+        m_region_stats = stats;
+
+        std::stringstream ss;
+        ss << std::fixed << std::setprecision(1);
+        ss << name << " (" << stats.pixel_count << " px)"
+           << "  Mean: (" << stats.mean[0] << "," << stats.mean[1] << "," << stats.mean[2] << ")"
+           << "  Min: (" << stats.min[0] << "," << stats.min[1] << "," << stats.min[2] << ")"
+           << "  Max: (" << stats.max[0] << "," << stats.max[1] << "," << stats.max[2] << ")"
+           << "  Unique colors: " << stats.unique_colors;
+        m_region_info.set_text(ss.str());
+        m_histogram_area.queue_draw();
+    }
+
     void on_get_color_clicked() {
         if (!m_pixbuf) return;
 
@@ -154,7 +987,7 @@ protected:
     }
 
     void on_image_clicked(int n_press, double x, double y) {
-        if (!m_pixbuf) return;
+        if (!m_pixbuf || m_region_mode != RegionMode::Pixel) return;
 
         // Convert coordinates based on scaling
         double scale = std::min(
@@ -210,9 +1043,199 @@ protected:
 };
 
 
+// Appends value in decimal to out; returns the new end
+static char* write_int(char* out, long value) {
+    // Negated as unsigned, so LONG_MIN has a magnitude too
+    unsigned long magnitude = static_cast<unsigned long>(value);
+    if (value < 0) {
+        *out++ = '-';
+        magnitude = 0ul - magnitude;
+    }
+    char digits[20];
+    int n = 0;
+    do {
+        digits[n++] = static_cast<char>('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude > 0);
+    while (n > 0) {
+        *out++ = digits[--n];
+    }
+    return out;
+}
+
+// Parses an optionally signed integer at p, skipping leading separators; returns false at end of line/input.
+// Values past INT_MAX are clamped to +-INT_MAX, which is outside any image
+static bool parse_int(const char*& p, const char* end, long& value) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == ',' || *p == '\r')) p++;
+    if (p >= end || *p == '\n') return false;
+
+    bool negative = false;
+    if (*p == '-' || *p == '+') {
+        negative = (*p == '-');
+        p++;
+    }
+    if (p >= end || *p < '0' || *p > '9') return false;
+
+    value = 0;
+    while (p < end && *p >= '0' && *p <= '9') {
+        value = static_cast<long>(std::min<long long>(INT_MAX, value * 10LL + (*p - '0')));
+        p++;
+    }
+    if (negative) value = -value;
+    return true;
+}
+
+/**
+ * Samples every "x y" line of coords in [begin, end) and formats one output
+ * line per coordinate: "x y R G B #rrggbb", or "x y out_of_bounds".
+ */
+static size_t sample_chunk(const Glib::RefPtr<Gdk::Pixbuf>& pixbuf,
+                           const char* begin, const char* end, std::string& out) {
+    static const char hex[] = "0123456789abcdef";
+
+    const guint8* pixels = pixbuf->get_pixels();
+    int channels = pixbuf->get_n_channels();
+    int rowstride = pixbuf->get_rowstride();
+    int width = pixbuf->get_width();
+    int height = pixbuf->get_height();
+
+    // Output lines are typically ~3x their input line; grown below if needed
+    out.resize((end - begin) * 3 + 64);
+    char* o = &out[0];
+    size_t count = 0;
+
+    const char* p = begin;
+    while (p < end) {
+        const char* line_end = static_cast<const char*>(memchr(p, '\n', end - p));
+        if (!line_end) line_end = end;
+
+        long x, y;
+        if (parse_int(p, line_end, x) && parse_int(p, line_end, y)) {
+            if ((size_t)(o - &out[0]) + 64 > out.size()) {
+                size_t used = o - &out[0];
+                out.resize(out.size() * 2);
+                o = &out[0] + used;
+            }
+
+            o = write_int(o, x);
+            *o++ = ' ';
+            o = write_int(o, y);
+            if (x >= 0 && x < width && y >= 0 && y < height) {
+                const guint8* px = pixels + (size_t)y * rowstride + (size_t)x * channels;
+                for (int c = 0; c < 3; c++) {
+                    *o++ = ' ';
+                    o = write_int(o, px[c]);
+                }
+                *o++ = ' ';
+                *o++ = '#';
+                for (int c = 0; c < 3; c++) {
+                    *o++ = hex[px[c] >> 4];
+                    *o++ = hex[px[c] & 15];
+                }
+            } else {
+                memcpy(o, " out_of_bounds", 14);
+                o += 14;
+            }
+            *o++ = '\n';
+            count++;
+        }
+        p = line_end + 1;
+    }
+
+    out.resize(o - &out[0]);
+    return count;
+}
+
+/**
+ * Headless mode: decodes the image once, then looks up every coordinate in
+ * coords_path. The coordinate file is split into chunks at line boundaries
+ * which are sampled on separate threads and written out in order.
+ */
+static int run_batch_sampling(const std::string& image_path, const std::string& coords_path,
+                              const std::string& output_path) {
+    Glib::RefPtr<Gdk::Pixbuf> pixbuf;
+    try {
+        pixbuf = Gdk::Pixbuf::create_from_file(image_path);
+    } catch (const Glib::Error& ex) {
+        std::cerr << "Error loading image: " << ex.what() << std::endl;
+        return 1;
+    }
+
+    // Reading all coordinates in one go
+    std::ifstream infile(coords_path, std::ios::binary | std::ios::ate);
+    if (!infile) {
+        std::cerr << "Could not open coordinate file: " << coords_path << std::endl;
+        return 1;
+    }
+    std::string input(static_cast<size_t>(infile.tellg()), '\0');
+    infile.seekg(0);
+    infile.read(&input[0], input.size());
+
+    auto start = std::chrono::steady_clock::now();
+
+    // Chunk boundaries, moved forward to the next line start
+    int n_chunks = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<const char*> bounds;
+    const char* data = input.data();
+    const char* data_end = data + input.size();
+    bounds.push_back(data);
+    for (int i = 1; i < n_chunks; i++) {
+        const char* p = std::max(bounds.back(), data + input.size() * i / n_chunks);
+        const char* newline = static_cast<const char*>(memchr(p, '\n', data_end - p));
+        bounds.push_back(newline ? newline + 1 : data_end);
+    }
+    bounds.push_back(data_end);
+
+    std::vector<std::string> outputs(n_chunks);
+    std::vector<size_t> counts(n_chunks, 0);
+    parallel_for_bands(n_chunks, [&](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            counts[i] = sample_chunk(pixbuf, bounds[i], bounds[i + 1], outputs[i]);
+        }
+    });
+
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start);
+
+    // Writing results in input order
+    FILE* out = output_path.empty() ? stdout : fopen(output_path.c_str(), "wb");
+    if (!out) {
+        std::cerr << "Could not open output file: " << output_path << std::endl;
+        return 1;
+    }
+    size_t total = 0;
+    bool written = true;
+    for (int i = 0; i < n_chunks; i++) {
+        written = fwrite(outputs[i].data(), 1, outputs[i].size(), out) == outputs[i].size() && written;
+        total += counts[i];
+    }
+    written = (out == stdout ? fflush(out) : fclose(out)) == 0 && written;
+    if (!written) {
+        std::cerr << "Could not write output: " << (output_path.empty() ? "stdout" : output_path) << std::endl;
+        return 1;
+    }
+
+    std::cerr << "Sampled " << total << " coordinates in " << elapsed.count() / 1000.0 << " ms" << std::endl;
+    return 0;
+}
+
+
 int main(int argc, char* argv[]) {
+    // Headless batch mode
+    if (argc >= 2 && std::string(argv[1]) == "--sample") {
+        if (argc != 4 && argc != 5) {
+            std::cerr << "Usage: " << argv[0] << " --sample <image> <coords_file> [output_file]" << std::endl;
+            return 1;
+        }
+        Gtk::init_gtkmm_internals();
+        return run_batch_sampling(argv[2], argv[3], argc == 5 ? argv[4] : "");
+    }
+
     auto app = Gtk::Application::create("org.gtkmm.pixel.viewer");
     return app->make_window_and_run<PixelViewer>(argc, argv);
 }
 
-// g++ -o A4 A4.cpp `pkg-config --cflags --libs gtkmm-4.0`
\ No newline at end of file
+// g++ -o A4 A4.cpp `pkg-config --cflags --libs gtkmm-4.0` -pthread
+
+// Batch sampling (one "x y" pair per line, prints "x y R G B #rrggbb"):
+// ./A4 --sample house.png coords.txt [colors.txt]
\ No newline at end of file
@@ -3,35 +3,354 @@
 #include <memory>
 #include <vector>
 #include <fstream>
+#include <string>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <cmath>
+#include <chrono>
+#include <atomic>
+#include <cstring>
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
 
 extern "C" {
     #include <libavcodec/avcodec.h>
     #include <libavformat/avformat.h>
     #include <libavutil/imgutils.h>
+    #include <libavutil/pixdesc.h>
     #include <libswscale/swscale.h>
 }
 
-// Structure to hold frame data
+// Structure to hold frame data. It owns the buffers the frame was decoded
+// into, which FrameViewer then displays in place without copying.
 struct FrameData {
-    std::vector<guint8> color_data;
-    std::vector<guint8> gray_data;
-    int width;
-    int height;
+    std::unique_ptr<uint8_t[]> color_data;  // RGB24, width * 3 bytes per row
+    std::unique_ptr<uint8_t[]> gray_data;   // One byte per pixel, gray_stride bytes per row
+    int width = 0;
+    int height = 0;
+    int gray_stride = 0;
+};
+
+
+// A decoded frame waiting to be written to disk
+struct WriteJob {
+    int frame_number;
+    std::unique_ptr<uint8_t[]> rgb_data;
+    std::unique_ptr<uint8_t[]> gray_data;
+};
+
+
+// Bounded queue between pipeline stages (decoding and the file writer, or
+// decoding and thumbnail scaling), so the producer never waits on the
+// consumer but also never runs more than a few items ahead
+template <typename T>
+class WorkQueue {
+private:
+    std::deque<T> jobs;
+    std::mutex mutex;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+    size_t capacity;
+    bool closed = false;
+
+public:
+    explicit WorkQueue(size_t capacity) : capacity(capacity) {}
+
+    void push(T job) {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_full.wait(lock, [this]() { return jobs.size() < capacity; });
+        jobs.push_back(std::move(job));
+        not_empty.notify_one();
+    }
+
+    // Returns false once the queue is closed and empty
+    bool pop(T& job) {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_empty.wait(lock, [this]() { return !jobs.empty() || closed; });
+        if (jobs.empty()) {
+            return false;
+        }
+        job = std::move(jobs.front());
+        jobs.pop_front();
+        not_full.notify_one();
+        return true;
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        not_empty.notify_all();
+    }
+};
+
+
+// Wraps sws_getCachedContext so the scaler is only rebuilt when the source
+// format or size changes, not once per converted frame. Frames whose format
+// or size changes mid-stream are still scaled to the requested output.
+class FrameConverter {
+private:
+    SwsContext* ctx = nullptr;
+
+public:
+    FrameConverter() = default;
+    FrameConverter(const FrameConverter&) = delete;
+    FrameConverter& operator=(const FrameConverter&) = delete;
+
+    ~FrameConverter() {
+        reset();
+    }
+
+    bool convert(const AVFrame* src, AVPixelFormat dst_format, int dst_width, int dst_height,
+                uint8_t* const dst_data[4], const int dst_linesize[4], int flags = SWS_BILINEAR) {
+        ctx = sws_getCachedContext(ctx,
+            src->width, src->height, (AVPixelFormat)src->format,
+            dst_width, dst_height, dst_format,
+            flags, nullptr, nullptr, nullptr);
+
+        if (!ctx) {
+            return false;
+        }
+
+        // swscale takes the range of YUV input from the pixel format alone; a frame
+        // tagged full range would otherwise have its levels stretched like 16-235 video
+        const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get((AVPixelFormat)src->format);
+        int* inv_table;
+        int* table;
+        int src_range, dst_range, brightness, contrast, saturation;
+        if (desc && !(desc->flags & AV_PIX_FMT_FLAG_RGB) &&
+            sws_getColorspaceDetails(ctx, &inv_table, &src_range, &table, &dst_range,
+                                     &brightness, &contrast, &saturation) >= 0) {
+            int range = is_full_range(src) ? 1 : 0;
+            if (range != src_range) {
+                sws_setColorspaceDetails(ctx, inv_table, range, table, dst_range, brightness, contrast, saturation);
+            }
+        }
+
+        sws_scale(ctx, src->data, src->linesize, 0, src->height, dst_data, dst_linesize);
+        return true;
+    }
+
+    // Whether the frame's samples span 0-255 rather than 16-235
+    static bool is_full_range(const AVFrame* src) {
+        return src->color_range == AVCOL_RANGE_JPEG || src->format == AV_PIX_FMT_GRAY8 ||
+            src->format == AV_PIX_FMT_YUVJ420P || src->format == AV_PIX_FMT_YUVJ422P ||
+            src->format == AV_PIX_FMT_YUVJ444P;
+    }
+
+    void reset() {
+        if (ctx) sws_freeContext(ctx);
+        ctx = nullptr;
+    }
 };
 
 
+// Gray coefficients in 2.14 fixed point; valid when each lies in [-2, 2)
+struct GrayWeights {
+    int16_t r;
+    int16_t g;
+    int16_t b;
+
+    static bool from_coeffs(float r_coeff, float g_coeff, float b_coeff, GrayWeights& weights) {
+        float coeffs[3] = { r_coeff, g_coeff, b_coeff };
+        int16_t fixed[3];
+        for (int i = 0; i < 3; i++) {
+            long value = std::lround(coeffs[i] * 16384.0f);
+            if (value < -32768 || value > 32767) return false;
+            fixed[i] = static_cast<int16_t>(value);
+        }
+        weights = { fixed[0], fixed[1], fixed[2] };
+        return true;
+    }
+};
+
+// The original float formula, clamped; used when the coefficients don't fit 2.14
+static void rgb_to_gray_float(const uint8_t* rgb, uint8_t* gray, size_t n,
+                            float r_coeff, float g_coeff, float b_coeff) {
+    for (size_t i = 0; i < n; i++) {
+        float value = r_coeff * rgb[i * 3] + g_coeff * rgb[i * 3 + 1] + b_coeff * rgb[i * 3 + 2];
+        gray[i] = static_cast<uint8_t>(std::min(255.0f, std::max(0.0f, value)));
+    }
+}
+
+static void rgb_to_gray_scalar(const uint8_t* rgb, uint8_t* gray, size_t n, const GrayWeights& w) {
+    for (size_t i = 0; i < n; i++) {
+        int sum = w.r * rgb[i * 3] + w.g * rgb[i * 3 + 1] + w.b * rgb[i * 3 + 2] + (1 << 13);
+        gray[i] = static_cast<uint8_t>(std::min(255, std::max(0, sum >> 14)));
+    }
+}
+
+#if defined(__SSSE3__)
+// Weighted sums of 4 packed RGB24 pixels starting at byte 'first' of src, as 32-bit lanes.
+// R and G are spread into 16-bit pairs and B into (B, 0) pairs, so one
+// multiply-add per pair gives r*R + g*G and b*B
+static inline __m128i gray_sums_ssse3(__m128i src, int first, __m128i rg_weights, __m128i b_weights) {
+    const char f = static_cast<char>(first);
+    const __m128i rg_mask = _mm_setr_epi8(f, -1, f + 1, -1, f + 3, -1, f + 4, -1,
+                                        f + 6, -1, f + 7, -1, f + 9, -1, f + 10, -1);
+    const __m128i b_mask = _mm_setr_epi8(f + 2, -1, -1, -1, f + 5, -1, -1, -1,
+                                        f + 8, -1, -1, -1, f + 11, -1, -1, -1);
+    __m128i sums = _mm_add_epi32(_mm_madd_epi16(_mm_shuffle_epi8(src, rg_mask), rg_weights),
+                                _mm_madd_epi16(_mm_shuffle_epi8(src, b_mask), b_weights));
+    return _mm_srai_epi32(_mm_add_epi32(sums, _mm_set1_epi32(1 << 13)), 14);
+}
+#endif
+
+#if defined(__AVX2__)
+// Same as gray_sums_ssse3 for 8 pixels: the low lane holds pixels 0-3 from
+// byte 0, the high lane pixels 4-7 at byte 4 of a load from byte 8, so
+// 8 pixels read exactly their 24 bytes
+static inline __m256i gray_sums_avx2(const uint8_t* rgb, __m256i rg_weights, __m256i b_weights) {
+    const __m256i rg_mask = _mm256_setr_epi8(0, -1, 1, -1, 3, -1, 4, -1, 6, -1, 7, -1, 9, -1, 10, -1,
+                                            4, -1, 5, -1, 7, -1, 8, -1, 10, -1, 11, -1, 13, -1, 14, -1);
+    const __m256i b_mask = _mm256_setr_epi8(2, -1, -1, -1, 5, -1, -1, -1, 8, -1, -1, -1, 11, -1, -1, -1,
+                                            6, -1, -1, -1, 9, -1, -1, -1, 12, -1, -1, -1, 15, -1, -1, -1);
+    __m256i src = _mm256_inserti128_si256(
+        _mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(rgb))),
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(rgb + 8)), 1);
+    __m256i sums = _mm256_add_epi32(_mm256_madd_epi16(_mm256_shuffle_epi8(src, rg_mask), rg_weights),
+                                    _mm256_madd_epi16(_mm256_shuffle_epi8(src, b_mask), b_weights));
+    return _mm256_srai_epi32(_mm256_add_epi32(sums, _mm256_set1_epi32(1 << 13)), 14);
+}
+#endif
+
+// rgb_to_gray_scalar using the widest vectors the build targets (AVX2, then SSSE3)
+static void rgb_to_gray_simd(const uint8_t* rgb, uint8_t* gray, size_t n, const GrayWeights& w) {
+    size_t i = 0;
+#if defined(__SSSE3__)
+    // Weight pairs for the 16-bit multiply-adds: (r, g) and (b, 0)
+    const int32_t rg = static_cast<int32_t>(static_cast<uint16_t>(w.r) |
+                                            (static_cast<uint32_t>(static_cast<uint16_t>(w.g)) << 16));
+    const int32_t b = static_cast<uint16_t>(w.b);
+#endif
+#if defined(__AVX2__)
+    const __m256i rg_weights256 = _mm256_set1_epi32(rg);
+    const __m256i b_weights256 = _mm256_set1_epi32(b);
+    // Packing works per 128-bit lane, leaving 4-pixel groups in the order
+    // 0, 2, 4, 6, 1, 3, 5, 7; the final permute puts them back in sequence
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    for (; i + 32 <= n; i += 32) {
+        const uint8_t* src = rgb + i * 3;
+        __m256i p0 = gray_sums_avx2(src, rg_weights256, b_weights256);
+        __m256i p1 = gray_sums_avx2(src + 24, rg_weights256, b_weights256);
+        __m256i p2 = gray_sums_avx2(src + 48, rg_weights256, b_weights256);
+        __m256i p3 = gray_sums_avx2(src + 72, rg_weights256, b_weights256);
+        __m256i bytes = _mm256_packus_epi16(_mm256_packs_epi32(p0, p1), _mm256_packs_epi32(p2, p3));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(gray + i), _mm256_permutevar8x32_epi32(bytes, order));
+    }
+#endif
+#if defined(__SSSE3__)
+    const __m128i rg_weights = _mm_set1_epi32(rg);
+    const __m128i b_weights = _mm_set1_epi32(b);
+    for (; i + 16 <= n; i += 16) {
+        const uint8_t* src = rgb + i * 3;
+        // Pixels 0-3 are bytes 0-11 of the first load, 4-7 bytes 4-15 of a load from byte 8
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+        __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 8));
+        __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 24));
+        __m128i e = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 32));
+        __m128i lo = _mm_packs_epi32(gray_sums_ssse3(a, 0, rg_weights, b_weights),
+                                    gray_sums_ssse3(c, 4, rg_weights, b_weights));
+        __m128i hi = _mm_packs_epi32(gray_sums_ssse3(d, 0, rg_weights, b_weights),
+                                    gray_sums_ssse3(e, 4, rg_weights, b_weights));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(gray + i), _mm_packus_epi16(lo, hi));
+    }
+#endif
+    rgb_to_gray_scalar(rgb + i * 3, gray + i, n - i, w);
+}
+
+
+// Parses a frame list such as "10", "10,20,30", "100-500" or "100-500:50"
+// (comma-separated numbers and start-end[:stride] ranges), sorted and without duplicates.
+// Ranges stop before frame 'limit', so "0-2000000000" on a short video lists its frames
+// instead of two billion numbers
+bool parse_frame_list(const std::string& text, std::vector<int>& frames, int64_t limit) {
+    frames.clear();
+    size_t pos = 0;
+    while (pos <= text.size()) {
+        size_t comma = text.find(',', pos);
+        std::string item = text.substr(pos, comma == std::string::npos ? std::string::npos : comma - pos);
+
+        try {
+            size_t dash = item.find('-', 1);
+            if (dash == std::string::npos) {
+                size_t used = 0;
+                int frame_number = std::stoi(item, &used);
+                if (used != item.size() || frame_number < 0) return false;
+                frames.push_back(frame_number);
+            } else {
+                size_t colon = item.find(':', dash);
+                std::string end_text = item.substr(dash + 1, colon == std::string::npos ? std::string::npos : colon - dash - 1);
+                size_t used_start = 0, used_end = 0, used_stride = 0;
+                int start = std::stoi(item.substr(0, dash), &used_start);
+                int end = std::stoi(end_text, &used_end);
+                int stride = 1;
+                if (colon != std::string::npos) {
+                    std::string stride_text = item.substr(colon + 1);
+                    stride = std::stoi(stride_text, &used_stride);
+                    if (used_stride != stride_text.size()) return false;
+                }
+                if (used_start != dash || used_end != end_text.size() ||
+                    start < 0 || end < start || stride <= 0) {
+                    return false;
+                }
+                // Counted in 64 bits so stepping past an end near INT_MAX can't overflow
+                int64_t last = std::min<int64_t>(end, limit - 1);
+                for (int64_t frame_number = start; frame_number <= last; frame_number += stride) {
+                    frames.push_back(static_cast<int>(frame_number));
+                }
+            }
+        } catch (const std::exception&) {
+            return false;
+        }
+
+        if (comma == std::string::npos) break;
+        pos = comma + 1;
+    }
+
+    std::sort(frames.begin(), frames.end());
+    frames.erase(std::unique(frames.begin(), frames.end()), frames.end());
+    return !frames.empty();
+}
+
+
 class FrameExtractor {
 private:
     AVFormatContext* fmt_ctx = nullptr;
     AVCodecContext* dec_ctx = nullptr;
-    SwsContext* sws_ctx = nullptr;
+    FrameConverter converter;
     AVFrame* frame = nullptr;
     AVPacket* pkt = nullptr;
     int video_stream_idx = -1;
     int width = 0;
     int height = 0;
 
-    bool open_codec_context(const char* filename) {
+    // Gray rows are padded to Cairo's A8 stride so the viewer can wrap them directly
+    int gray_stride = 0;
+
+    // Timestamp mapping for the video stream
+    AVRational time_base{0, 1};
+    AVRational frame_rate{0, 1};
+    int64_t start_pts = 0;
+
+    // Decoding position: index of the last frame decoded (-1 before the first)
+    int64_t last_index = -1;
+    bool index_known = true;
+    bool draining = false;
+
+    // Length of the video in frames, 0 if it cannot be told
+    int64_t total_frames = 0;
+
+    // Targets closer than this are reached by decoding forward instead of seeking
+    static constexpr int SEEK_DISTANCE = 64;
+
+    bool open_codec_context(const char* filename, bool dump_format = true) {
         // Opening input file
         if (avformat_open_input(&fmt_ctx, filename, nullptr, nullptr) < 0) {
             std::cerr << "Could not open source file" << std::endl;
@@ -46,7 +365,9 @@ private:
         }
 
         // Dump input information
-        av_dump_format(fmt_ctx, 0, filename, 0);
+        if (dump_format) {
+            av_dump_format(fmt_ctx, 0, filename, 0);
+        }
 
         // Finding the first video stream
         for (unsigned int i = 0; i < fmt_ctx->nb_streams; i++) {
@@ -67,6 +388,24 @@ private:
         AVCodecParameters* codecParams = video_stream->codecpar;
         width = codecParams->width;
         height = codecParams->height;
+        gray_stride = Cairo::ImageSurface::format_stride_for_width(Cairo::Format::A8, width);
+        time_base = video_stream->time_base;
+        frame_rate = av_guess_frame_rate(fmt_ctx, video_stream, nullptr);
+        start_pts = video_stream->start_time != AV_NOPTS_VALUE ? video_stream->start_time : 0;
+        last_index = -1;
+        index_known = true;
+        draining = false;
+
+        // Length in frames: from the container if it says, else from the duration
+        if (video_stream->nb_frames > 0) {
+            total_frames = video_stream->nb_frames;
+        } else if (frame_rate.num > 0 && frame_rate.den > 0 && video_stream->duration > 0) {
+            total_frames = av_rescale_q(video_stream->duration, time_base, av_inv_q(frame_rate));
+        } else if (frame_rate.num > 0 && frame_rate.den > 0 && fmt_ctx->duration > 0) {
+            total_frames = av_rescale_q(fmt_ctx->duration, AVRational{1, AV_TIME_BASE}, av_inv_q(frame_rate));
+        } else {
+            total_frames = 0;
+        }
 
         // Finding decoder
         const AVCodec* decoder = avcodec_find_decoder(codecParams->codec_id);
@@ -110,68 +449,242 @@ private:
         return true;
     }
 
-    bool decode_frame(int target_frame, std::unique_ptr<uint8_t[]>& rgb_data) {
-        int current_frame = 0;
+    // Frame numbers map to timestamps through the stream's frame rate and
+    // time base, so a target can be found without counting from the start
+    int64_t frame_to_pts(int64_t frame_number) const {
+        return start_pts + av_rescale_q(frame_number, av_inv_q(frame_rate), time_base);
+    }
+
+    int64_t pts_to_frame(int64_t pts) const {
+        return av_rescale_q_rnd(pts - start_pts, time_base, av_inv_q(frame_rate), AV_ROUND_NEAR_INF);
+    }
+
+    // Seeks to the keyframe at or before the target frame and resets the decoder
+    bool seek_to_frame(int64_t target_frame) {
+        if (frame_rate.num <= 0 || frame_rate.den <= 0) {
+            return false;
+        }
+
+        if (av_seek_frame(fmt_ctx, video_stream_idx, frame_to_pts(target_frame), AVSEEK_FLAG_BACKWARD) < 0) {
+            return false;
+        }
+
+        avcodec_flush_buffers(dec_ctx);
+        draining = false;
+        last_index = -1;
+        index_known = false;
+        return true;
+    }
+
+    // Rewinds to the first frame; decoding then counts frames from zero
+    bool rewind() {
+        if (av_seek_frame(fmt_ctx, video_stream_idx, start_pts, AVSEEK_FLAG_BACKWARD) < 0) {
+            return false;
+        }
+
+        avcodec_flush_buffers(dec_ctx);
+        draining = false;
+        last_index = -1;
+        index_known = true;
+        return true;
+    }
+
+    // Decodes the next video frame into 'frame', draining the decoder at end of file
+    bool next_frame() {
+        while (true) {
+            int ret = avcodec_receive_frame(dec_ctx, frame);
+            if (ret >= 0) {
+                return true;
+            } else if (ret != AVERROR(EAGAIN) || draining) {
+                return false;
+            }
+
+            if (av_read_frame(fmt_ctx, pkt) < 0) {
+                avcodec_send_packet(dec_ctx, nullptr);
+                draining = true;
+                continue;
+            }
 
-        while (av_read_frame(fmt_ctx, pkt) >= 0) {
             if (pkt->stream_index == video_stream_idx) {
-                int ret = avcodec_send_packet(dec_ctx, pkt);
-                if (ret < 0) {
+                ret = avcodec_send_packet(dec_ctx, pkt);
+                if (ret < 0 && ret != AVERROR(EAGAIN)) {
                     av_packet_unref(pkt);
                     return false;
                 }
+            }
+            av_packet_unref(pkt);
+        }
+    }
 
-                while (ret >= 0) {
-                    ret = avcodec_receive_frame(dec_ctx, frame);
-                    if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
-                        break;
-                    } else if (ret < 0) {
-                        return false;
-                    }
+    // Frame number of the frame just decoded, or -1 if it cannot be told yet
+    // (no timestamp right after a seek)
+    int64_t current_index() {
+        int64_t pts = frame->best_effort_timestamp;
+        if (pts != AV_NOPTS_VALUE && frame_rate.num > 0 && frame_rate.den > 0) {
+            last_index = pts_to_frame(pts);
+            index_known = true;
+        } else if (index_known) {
+            last_index++;
+        } else {
+            return -1;
+        }
+        return last_index;
+    }
 
-                    if (current_frame == target_frame) {
-                        // Convert frame to RGB24
-                        int rgb_buffer_size = av_image_get_buffer_size(
-                            AV_PIX_FMT_RGB24, width, height, 1);
-                        rgb_data = std::make_unique<uint8_t[]>(rgb_buffer_size);
-
-                        sws_ctx = sws_getContext(
-                            width, height, (AVPixelFormat)frame->format,
-                            width, height, AV_PIX_FMT_RGB24,
-                            SWS_BILINEAR, nullptr, nullptr, nullptr);
-
-                        if (!sws_ctx) {
-                            return false;
-                        }
-
-                        uint8_t* rgb_ptrs[4] = { rgb_data.get(), nullptr, nullptr, nullptr };
-                        int rgb_linesizes[4] = { 3 * width, 0, 0, 0 };
-                        sws_scale(sws_ctx, frame->data, frame->linesize, 0,
-                                height, rgb_ptrs, rgb_linesizes);
-
-                        sws_freeContext(sws_ctx);
-                        sws_ctx = nullptr;
-                        av_packet_unref(pkt);
-                        return true;
-                    }
-                    current_frame++;
+    bool convert_frame(std::unique_ptr<uint8_t[]>& rgb_data) {
+        // Convert frame to RGB24
+        int rgb_buffer_size = av_image_get_buffer_size(
+            AV_PIX_FMT_RGB24, width, height, 1);
+        rgb_data = std::make_unique<uint8_t[]>(rgb_buffer_size);
+
+        uint8_t* rgb_ptrs[4] = { rgb_data.get(), nullptr, nullptr, nullptr };
+        int rgb_linesizes[4] = { 3 * width, 0, 0, 0 };
+        return converter.convert(frame, AV_PIX_FMT_RGB24, width, height, rgb_ptrs, rgb_linesizes);
+    }
+
+    // Formats whose first plane is 8-bit luma at full resolution
+    static bool has_luma_plane(int format) {
+        switch (format) {
+            case AV_PIX_FMT_YUV420P: case AV_PIX_FMT_YUVJ420P:
+            case AV_PIX_FMT_YUV422P: case AV_PIX_FMT_YUVJ422P:
+            case AV_PIX_FMT_YUV444P: case AV_PIX_FMT_YUVJ444P:
+            case AV_PIX_FMT_YUV410P: case AV_PIX_FMT_YUV411P:
+            case AV_PIX_FMT_NV12: case AV_PIX_FMT_NV21:
+            case AV_PIX_FMT_GRAY8:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    // The BT.601 weights are what swscale uses to produce our RGB, so for them
+    // the decoded Y plane already is the gray image
+    static bool is_luma_coeffs(float r_coeff, float g_coeff, float b_coeff) {
+        return std::fabs(r_coeff - 0.299f) < 0.0005f &&
+            std::fabs(g_coeff - 0.587f) < 0.0005f &&
+            std::fabs(b_coeff - 0.114f) < 0.0005f;
+    }
+
+    // Fills gray_data (gray_stride * height bytes) for the frame just decoded: from
+    // the Y plane when possible, otherwise weighted from rgb_data by the vector kernel
+    void compute_gray(const uint8_t* rgb_data, float r_coeff, float g_coeff, float b_coeff,
+                    std::unique_ptr<uint8_t[]>& gray_data) {
+        gray_data = std::make_unique<uint8_t[]>((size_t)gray_stride * height);
+
+        if (is_luma_coeffs(r_coeff, g_coeff, b_coeff) && has_luma_plane(frame->format) &&
+            frame->width == width && frame->height == height) {
+            // Limited range luma (16-235) is stretched to 0-255 like the RGB path does
+            uint8_t levels[256];
+            bool full_range = FrameConverter::is_full_range(frame);
+            for (int v = 0; v < 256; v++) {
+                long stretched = full_range ? v : std::lround((v - 16) * 255.0 / 219.0);
+                levels[v] = static_cast<uint8_t>(std::min(255L, std::max(0L, stretched)));
+            }
+
+            for (int y = 0; y < height; y++) {
+                const uint8_t* luma = frame->data[0] + (ptrdiff_t)y * frame->linesize[0];
+                uint8_t* out = gray_data.get() + (ptrdiff_t)y * gray_stride;
+                for (int x = 0; x < width; x++) {
+                    out[x] = levels[luma[x]];
                 }
             }
-            av_packet_unref(pkt);
+            return;
+        }
+
+        GrayWeights weights;
+        bool fixed_point = GrayWeights::from_coeffs(r_coeff, g_coeff, b_coeff, weights);
+        for (int y = 0; y < height; y++) {
+            const uint8_t* rgb_row = rgb_data + (size_t)y * width * 3;
+            uint8_t* out = gray_data.get() + (size_t)y * gray_stride;
+            if (fixed_point) {
+                rgb_to_gray_simd(rgb_row, out, width, weights);
+            } else {
+                rgb_to_gray_float(rgb_row, out, width, r_coeff, g_coeff, b_coeff);
+            }
+        }
+    }
+
+    // Leaves the target frame (or the first one past it) in 'frame'
+    bool find_frame(int target_frame) {
+        // Nearby frames are cheaper to decode forward than to seek to, since a
+        // seek lands on the preceding keyframe anyway
+        bool seeked = false;
+        if (target_frame <= last_index || target_frame > last_index + SEEK_DISTANCE) {
+            seeked = seek_to_frame(target_frame);
+            if (!seeked && target_frame <= last_index && !rewind()) {
+                return false;
+            }
+        }
+
+        while (next_frame()) {
+            int64_t index = current_index();
+
+            // Timestamps missing after a seek, or a demuxer that landed past the
+            // target: fall back to counting from the first frame
+            if (seeked && (index < 0 || index > target_frame)) {
+                seeked = false;
+                if (!rewind()) {
+                    return false;
+                }
+                continue;
+            }
+            seeked = false;
+
+            // A variable frame rate stream may skip numbers; take the first
+            // frame at or past the target
+            if (index >= target_frame) {
+                return true;
+            }
         }
         return false;
     }
 
+    bool decode_frame(int target_frame, std::unique_ptr<uint8_t[]>& rgb_data) {
+        return find_frame(target_frame) && convert_frame(rgb_data);
+    }
+
 public:
     ~FrameExtractor() {
         cleanup();
     }
 
+    // Opens a video for grab_frame; the size and length are then available
+    bool open(const std::string& filename, bool dump_format) {
+        cleanup();
+        return open_codec_context(filename.c_str(), dump_format);
+    }
+
+    void close() {
+        cleanup();
+    }
+
+    int frame_width() const { return width; }
+    int frame_height() const { return height; }
+    int64_t frame_count() const { return total_frames; }
+
+    // Returns a new reference to a decoded frame near target_frame, or nullptr.
+    // With exact set it is the target frame itself; otherwise it is the keyframe
+    // at or before it, and every other frame is skipped by the decoder, so each
+    // grab costs one seek and one keyframe decode. A stream that can't seek
+    // falls back to the exact search rather than returning the first frame.
+    AVFrame* grab_frame(int target_frame, bool exact) {
+        bool found = false;
+        if (!exact) {
+            dec_ctx->skip_frame = AVDISCARD_NONKEY;
+            found = seek_to_frame(target_frame) && next_frame();
+        }
+        if (!found) {
+            dec_ctx->skip_frame = AVDISCARD_DEFAULT;
+            if (!find_frame(target_frame)) {
+                return nullptr;
+            }
+        }
+        return av_frame_clone(frame);
+    }
+
     FrameData extract_frames(const std::string& filename, int target_frame,
                             float r_coeff, float g_coeff, float b_coeff) {
         FrameData result;
-        result.width = 0;
-        result.height = 0;
 
         if (!open_codec_context(filename.c_str())) {
             return result;
@@ -179,46 +692,91 @@ public:
 
         result.width = width;
         result.height = height;
+        result.gray_stride = gray_stride;
 
-        std::unique_ptr<uint8_t[]> rgb_data;
-        if (!decode_frame(target_frame, rgb_data)) {
+        // The decoded buffer becomes the color data as is
+        if (!decode_frame(target_frame, result.color_data)) {
             cleanup();
+            result.width = 0;
+            result.height = 0;
             return result;
         }
 
-        // Store color data
-        result.color_data.assign(rgb_data.get(), rgb_data.get() + (width * height * 3));
-
-        // Creating grayscale data
-        result.gray_data.resize(width * height * 3);
-        for (int i = 0; i < width * height; i++) {
-            uint8_t gray = static_cast<uint8_t>(
-                r_coeff * rgb_data[i * 3] +
-                g_coeff * rgb_data[i * 3 + 1] +
-                b_coeff * rgb_data[i * 3 + 2]
-            );
-            result.gray_data[i * 3] = gray;
-            result.gray_data[i * 3 + 1] = gray;
-            result.gray_data[i * 3 + 2] = gray;
-        }
+        // Creating grayscale data, computed once for both the viewer and the PGM
+        compute_gray(result.color_data.get(), r_coeff, g_coeff, b_coeff, result.gray_data);
 
         // Saving PPM/PGM files
-        save_ppm(result.color_data.data(), "frame_color.ppm");
-        save_pgm(result.color_data.data(), "frame_gray.pgm", r_coeff, g_coeff, b_coeff);
+        save_ppm(result.color_data.get(), "frame_color.ppm");
+        save_pgm(result.gray_data.get(), "frame_gray.pgm");
 
         cleanup();
         return result;
     }
 
+    // Extracts every frame in 'frames' (sorted ascending) in one pass over the
+    // file, seeking between distant targets. Each frame is saved as
+    // frame_<n>_color.ppm and frame_<n>_gray.pgm by a separate writer thread.
+    // Returns the number of frames written.
+    int extract_frame_list(const std::string& filename, const std::vector<int>& frames,
+                            float r_coeff, float g_coeff, float b_coeff) {
+        if (!open_codec_context(filename.c_str())) {
+            return 0;
+        }
+
+        WorkQueue<WriteJob> queue(4);
+        int written = 0;
+        std::thread writer([&]() {
+            WriteJob job;
+            while (queue.pop(job)) {
+                std::string stem = "frame_" + std::to_string(job.frame_number);
+                bool ok = save_ppm(job.rgb_data.get(), (stem + "_color.ppm").c_str());
+                ok = save_pgm(job.gray_data.get(), (stem + "_gray.pgm").c_str()) && ok;
+                if (ok) {
+                    written++;
+                } else {
+                    std::cerr << "Could not write " << stem << " files" << std::endl;
+                }
+            }
+        });
+
+        // Closes the queue and joins the writer however the loop below is left, since
+        // destroying a joinable std::thread would terminate the program
+        struct WriterJoin {
+            WorkQueue<WriteJob>& queue;
+            std::thread& writer;
+            ~WriterJoin() {
+                queue.close();
+                if (writer.joinable()) writer.join();
+            }
+        } writer_join{queue, writer};
+
+        for (int target_frame : frames) {
+            WriteJob job;
+            job.frame_number = target_frame;
+            if (!decode_frame(target_frame, job.rgb_data)) {
+                std::cerr << "Could not extract frame " << target_frame << std::endl;
+                // Frames are sorted, so a frame past the end means the rest are too
+                if (draining) break;
+                continue;
+            }
+            compute_gray(job.rgb_data.get(), r_coeff, g_coeff, b_coeff, job.gray_data);
+            queue.push(std::move(job));
+        }
+
+        queue.close();
+        writer.join();
+        cleanup();
+        return written;
+    }
+
 private:
     void cleanup() {
-        if (sws_ctx) sws_freeContext(sws_ctx);
+        converter.reset();
         if (frame) av_frame_free(&frame);
         if (pkt) av_packet_free(&pkt);
         if (dec_ctx) avcodec_free_context(&dec_ctx);
         if (fmt_ctx) avformat_close_input(&fmt_ctx);
         
-        sws_ctx = nullptr;
         frame = nullptr;
         pkt = nullptr;
         dec_ctx = nullptr;
@@ -234,19 +792,12 @@ private:
         return outfile.good();
     }
 
-    bool save_pgm(const uint8_t* rgb_data, const char* filename,
-                    float r_coeff, float g_coeff, float b_coeff) {
+    bool save_pgm(const uint8_t* gray_data, const char* filename) {
         std::ofstream outfile(filename, std::ios::binary);
         if (!outfile) return false;
         outfile << "P5\n" << width << " " << height << "\n255\n";
-        for (int i = 0; i < width * height; i++) {
-            int rgb_pos = i * 3;
-            uint8_t gray = static_cast<uint8_t>(
-                r_coeff * rgb_data[rgb_pos] +
-                g_coeff * rgb_data[rgb_pos + 1] +
-                b_coeff * rgb_data[rgb_pos + 2]
-            );
-            outfile.write(reinterpret_cast<const char*>(&gray), 1);
+        for (int y = 0; y < height; y++) {
+            outfile.write(reinterpret_cast<const char*>(gray_data + (size_t)y * gray_stride), width);
         }
         return outfile.good();
     }
@@ -263,11 +814,13 @@ private:
     Gtk::Label m_color_label{"Color Frame"};
     Gtk::Label m_gray_label{"Grayscale Frame"};
     
+    // The viewer owns the decoded buffers; the pixbuf and surface below wrap them in place
+    FrameData m_frames;
     Glib::RefPtr<Gdk::Pixbuf> m_color_pixbuf;
-    Glib::RefPtr<Gdk::Pixbuf> m_gray_pixbuf;
+    Cairo::RefPtr<Cairo::ImageSurface> m_gray_surface;
 
 public:
-    FrameViewer(const FrameData& frames) {
+    FrameViewer(FrameData&& frames) : m_frames(std::move(frames)) {
         std::cout << "Creating FrameViewer..." << std::endl;
         
         set_title("Frame Viewer");
@@ -289,16 +842,16 @@ public:
 
         // Setting up color image
         m_color_box.append(m_color_label);
-        if (!frames.color_data.empty()) {
+        if (m_frames.color_data) {
             try {
                 m_color_pixbuf = Gdk::Pixbuf::create_from_data(
-                    frames.color_data.data(),
+                    m_frames.color_data.get(),
                     Gdk::Colorspace::RGB,
                     false,
                     8,
-                    frames.width,
-                    frames.height,
-                    frames.width * 3
+                    m_frames.width,
+                    m_frames.height,
+                    m_frames.width * 3
                 );
                 
                 m_color_area.set_draw_func(sigc::mem_fun(*this, &FrameViewer::on_draw_color));
@@ -311,22 +864,21 @@ public:
 
         // Setting up grayscale image
         m_gray_box.append(m_gray_label);
-        if (!frames.gray_data.empty()) {
+        if (m_frames.gray_data) {
             try {
-                m_gray_pixbuf = Gdk::Pixbuf::create_from_data(
-                    frames.gray_data.data(),
-                    Gdk::Colorspace::RGB,
-                    false,
-                    8,
-                    frames.width,
-                    frames.height,
-                    frames.width * 3
+                // Single-channel gray is used as an A8 mask, painting white over black
+                m_gray_surface = Cairo::ImageSurface::create(
+                    m_frames.gray_data.get(),
+                    Cairo::Format::A8,
+                    m_frames.width,
+                    m_frames.height,
+                    m_frames.gray_stride
                 );
                 
                 m_gray_area.set_draw_func(sigc::mem_fun(*this, &FrameViewer::on_draw_gray));
             }
-            catch (const Glib::Error& ex) {
-                std::cerr << "Error creating grayscale Pixbuf: " << ex.what() << std::endl;
+            catch (const std::exception& ex) {
+                std::cerr << "Error creating grayscale surface: " << ex.what() << std::endl;
             }
         }
         m_gray_box.append(m_gray_area);
@@ -365,48 +917,314 @@ protected:
     }
 
     void on_draw_gray(const Cairo::RefPtr<Cairo::Context>& cr, int width, int height) {
-        if (m_gray_pixbuf) {
+        if (m_gray_surface) {
             // Calculate scaling factors
-            double img_aspect = (double)m_gray_pixbuf->get_width() / m_gray_pixbuf->get_height();
+            double img_aspect = (double)m_frames.width / m_frames.height;
             double area_aspect = (double)width / height;
             
             double scale_x, scale_y;
             if (img_aspect > area_aspect) {
-                scale_x = (double)width / m_gray_pixbuf->get_width();
+                scale_x = (double)width / m_frames.width;
                 scale_y = scale_x;
             } else {
-                scale_y = (double)height / m_gray_pixbuf->get_height();
+                scale_y = (double)height / m_frames.height;
                 scale_x = scale_y;
             }
 
             // Center the image
-            double offset_x = (width - m_gray_pixbuf->get_width() * scale_x) / 2;
-            double offset_y = (height - m_gray_pixbuf->get_height() * scale_y) / 2;
+            double offset_x = (width - m_frames.width * scale_x) / 2;
+            double offset_y = (height - m_frames.height * scale_y) / 2;
 
             cr->translate(offset_x, offset_y);
             cr->scale(scale_x, scale_y);
-            Gdk::Cairo::set_source_pixbuf(cr, m_gray_pixbuf, 0, 0);
-            cr->paint();
+            cr->set_source_rgb(0, 0, 0);
+            cr->rectangle(0, 0, m_frames.width, m_frames.height);
+            cr->fill();
+            cr->set_source_rgb(1, 1, 1);
+            cr->mask(m_gray_surface, 0, 0);
+        }
+    }
+};
+
+
+// Compares the original float gray loop (three bytes out per pixel) with the
+// fixed-point scalar and vector kernels on a 4K RGB frame
+static int run_gray_benchmark() {
+    const int WIDTH = 3840;
+    const int HEIGHT = 2160;
+    const int RUNS = 10;
+    const float r_coeff = 0.2126f, g_coeff = 0.7152f, b_coeff = 0.0722f;
+    const size_t pixels = (size_t)WIDTH * HEIGHT;
+
+    std::vector<uint8_t> rgb(pixels * 3);
+    for (size_t i = 0; i < rgb.size(); i++) {
+        rgb[i] = static_cast<uint8_t>(i * 7 + i / (WIDTH * 3));
+    }
+    std::vector<uint8_t> tripled(pixels * 3), scalar_gray(pixels), simd_gray(pixels);
+    GrayWeights weights;
+    GrayWeights::from_coeffs(r_coeff, g_coeff, b_coeff, weights);
+
+    // Best of several runs, in milliseconds
+    auto time_best = [&](auto&& convert) {
+        double best = 1e30;
+        for (int run = 0; run < RUNS; run++) {
+            auto start = std::chrono::steady_clock::now();
+            convert();
+            std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+            best = std::min(best, elapsed.count());
         }
+        return best;
+    };
+
+    double float_ms = time_best([&]() {
+        for (size_t i = 0; i < pixels; i++) {
+            uint8_t gray = static_cast<uint8_t>(
+                r_coeff * rgb[i * 3] +
+                g_coeff * rgb[i * 3 + 1] +
+                b_coeff * rgb[i * 3 + 2]
+            );
+            tripled[i * 3] = gray;
+            tripled[i * 3 + 1] = gray;
+            tripled[i * 3 + 2] = gray;
+        }
+    });
+    double scalar_ms = time_best([&]() { rgb_to_gray_scalar(rgb.data(), scalar_gray.data(), pixels, weights); });
+    double simd_ms = time_best([&]() { rgb_to_gray_simd(rgb.data(), simd_gray.data(), pixels, weights); });
+
+    // Fixed point rounds where the float loop truncates, so they may differ by one
+    int max_diff = 0;
+    for (size_t i = 0; i < pixels; i++) {
+        max_diff = std::max(max_diff, std::abs(simd_gray[i] - tripled[i * 3]));
     }
+
+    std::cout << WIDTH << "x" << HEIGHT << " RGB24 to gray, best of " << RUNS << ":" << std::endl;
+    std::cout << "  float loop, 3 bytes out: " << float_ms << " ms" << std::endl;
+    std::cout << "  fixed point scalar:      " << scalar_ms << " ms" << std::endl;
+    std::cout << "  fixed point simd:        " << simd_ms << " ms ("
+              << float_ms / std::max(simd_ms, 1e-6) << "x)"
+              << (scalar_gray == simd_gray ? "" : "  MISMATCH") << std::endl;
+    std::cout << "  largest difference from the float loop: " << max_diff << std::endl;
+    return 0;
+}
+
+
+// A decoded frame on its way to being scaled into the contact sheet
+struct ThumbJob {
+    int index;
+    AVFrame* frame;
 };
 
+/**
+ * Writes a contact sheet of 'count' evenly spaced frames from a video to
+ * output (PNG, or PPM if the name ends in .ppm). Decoder threads each open
+ * the file and grab a contiguous run of the frames, only keyframes unless
+ * exact is set; scaler threads turn them into thumb_width wide thumbnails
+ * straight from the decoded format and copy them into the grid.
+ */
+static int run_contact_sheet(const std::string& filename, int count, const std::string& output,
+                            int thumb_width, bool exact) {
+    FrameExtractor probe;
+    if (!probe.open(filename, true)) {
+        return 1;
+    }
+    int width = probe.frame_width();
+    int height = probe.frame_height();
+    int64_t total = probe.frame_count();
+    probe.close();
+
+    if (total <= 0 || width <= 0 || height <= 0) {
+        std::cerr << "Could not determine the length of the video" << std::endl;
+        return 1;
+    }
+    count = (int)std::min<int64_t>(count, total);
+
+    // Thumbnails keep the frame's aspect ratio, in a roughly square grid
+    const int GAP = 4;
+    int thumb_height = std::max(1, (int)std::lround((double)thumb_width * height / width));
+    int columns = (int)std::ceil(std::sqrt((double)count));
+    int rows = (count + columns - 1) / columns;
+    int sheet_width = columns * (thumb_width + GAP) + GAP;
+    int sheet_height = rows * (thumb_height + GAP) + GAP;
+    int sheet_stride = sheet_width * 3;
+    std::vector<uint8_t> sheet((size_t)sheet_stride * sheet_height, 0);
+
+    // The middle frame of each of 'count' equal parts of the video
+    std::vector<int> targets(count);
+    for (int i = 0; i < count; i++) {
+        targets[i] = (int)((2 * (int64_t)i + 1) * total / (2 * count));
+    }
+
+    int cores = (int)std::max(1u, std::thread::hardware_concurrency());
+    int decoders = std::max(1, std::min(count, cores / 2));
+    int scalers = std::max(1, cores - decoders);
+
+    WorkQueue<ThumbJob> queue(2 * scalers);
+    std::atomic<int> decoders_left(decoders);
+    std::atomic<int> failed(0);
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> threads;
+    for (int d = 0; d < decoders; d++) {
+        threads.emplace_back([&, d]() {
+            // Each decoder's targets are in order, so it only ever seeks forward
+            int first = d * count / decoders;
+            int last = (d + 1) * count / decoders;
+            FrameExtractor extractor;
+            if (extractor.open(filename, false)) {
+                for (int i = first; i < last; i++) {
+                    AVFrame* grabbed = extractor.grab_frame(targets[i], exact);
+                    if (grabbed) {
+                        queue.push({i, grabbed});
+                    } else {
+                        std::cerr << "Could not decode frame " << targets[i] << std::endl;
+                        failed++;
+                    }
+                }
+            } else {
+                failed += last - first;
+            }
+
+            // The last decoder to finish lets the scalers run dry
+            if (--decoders_left == 0) {
+                queue.close();
+            }
+        });
+    }
+
+    for (int s = 0; s < scalers; s++) {
+        threads.emplace_back([&]() {
+            FrameConverter converter;
+            uint8_t* thumb[4] = { nullptr, nullptr, nullptr, nullptr };
+            int thumb_linesize[4] = { 0, 0, 0, 0 };
+            bool have_thumb = av_image_alloc(thumb, thumb_linesize, thumb_width, thumb_height,
+                                            AV_PIX_FMT_RGB24, 32) >= 0;
+
+            ThumbJob job;
+            while (queue.pop(job)) {
+                // SWS_AREA averages over the source pixels, which suits large reductions
+                if (have_thumb && converter.convert(job.frame, AV_PIX_FMT_RGB24, thumb_width, thumb_height,
+                                                    thumb, thumb_linesize, SWS_AREA)) {
+                    int x = GAP + (job.index % columns) * (thumb_width + GAP);
+                    int y = GAP + (job.index / columns) * (thumb_height + GAP);
+                    for (int row = 0; row < thumb_height; row++) {
+                        memcpy(sheet.data() + (size_t)(y + row) * sheet_stride + x * 3,
+                            thumb[0] + (size_t)row * thumb_linesize[0], thumb_width * 3);
+                    }
+                } else {
+                    failed++;
+                }
+                av_frame_free(&job.frame);
+            }
+
+            if (have_thumb) {
+                av_freep(&thumb[0]);
+            }
+        });
+    }
+
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+
+    // Saving the sheet
+    bool saved = false;
+    if (output.size() >= 4 && output.compare(output.size() - 4, 4, ".ppm") == 0) {
+        std::ofstream outfile(output, std::ios::binary);
+        outfile << "P6\n" << sheet_width << " " << sheet_height << "\n255\n";
+        outfile.write(reinterpret_cast<const char*>(sheet.data()), sheet.size());
+        saved = outfile.good();
+    } else {
+        try {
+            auto pixbuf = Gdk::Pixbuf::create_from_data(sheet.data(), Gdk::Colorspace::RGB, false, 8,
+                                                        sheet_width, sheet_height, sheet_stride);
+            pixbuf->save(output, "png");
+            saved = true;
+        } catch (const Glib::Error& ex) {
+            std::cerr << "Error saving contact sheet: " << ex.what() << std::endl;
+        }
+    }
+
+    std::cout << "Contact sheet of " << count << (exact ? " exact frames" : " keyframes")
+              << " in " << elapsed.count() << " ms (" << decoders << " decoders, "
+              << scalers << " scalers), " << failed << " failed";
+    if (saved) {
+        std::cout << ", written to " << output;
+    }
+    std::cout << std::endl;
+    return saved && failed < count ? 0 : 1;
+}
+
 
 int main(int argc, char* argv[]) {
+    // Headless contact sheet of evenly spaced frames
+    if (argc >= 2 && std::string(argv[1]) == "--contact-sheet") {
+        bool exact = false;
+        std::vector<std::string> args;
+        for (int i = 2; i < argc; i++) {
+            if (std::string(argv[i]) == "--exact") {
+                exact = true;
+            } else {
+                args.push_back(argv[i]);
+            }
+        }
+        int count = args.size() >= 2 ? atoi(args[1].c_str()) : 0;
+        int thumb_width = args.size() >= 4 ? atoi(args[3].c_str()) : 320;
+        if (args.size() < 3 || args.size() > 4 || count <= 0 || thumb_width <= 0) {
+            std::cerr << "Usage: " << argv[0]
+                      << " --contact-sheet <video_file> <count> <output.png|.ppm> [thumb_width] [--exact]" << std::endl;
+            return 1;
+        }
+        Gtk::init_gtkmm_internals();
+        return run_contact_sheet(args[0], count, args[2], thumb_width, exact);
+    }
+
+    // Headless gray kernel benchmark
+    if (argc == 2 && std::string(argv[1]) == "--bench-gray") {
+        return run_gray_benchmark();
+    }
+
     if (argc != 6) {
         std::cerr << "Usage: " << argv[0] << " <video_file> <frame_number> <r_coeff> <g_coeff> <b_coeff>" << std::endl;
+        std::cerr << "       <frame_number> may also be a list or range: 10,20,30 or 100-500:50" << std::endl;
         return 1;
     }
 
     // Parsing arguments
     const char* filename = argv[1];
-    int target_frame = std::stoi(argv[2]);
+
+    // The video's length bounds the ranges in the frame list; when the container
+    // doesn't give one, about a day at 30 fps stands in for it
+    int64_t frame_limit = 0;
+    {
+        FrameExtractor probe;
+        if (!probe.open(filename, false)) {
+            return 1;
+        }
+        frame_limit = probe.frame_count() > 0 ? probe.frame_count() : 30 * 60 * 60 * 24;
+    }
+
+    std::vector<int> frame_list;
+    if (!parse_frame_list(argv[2], frame_list, frame_limit)) {
+        std::cerr << "Invalid frame list: " << argv[2] << std::endl;
+        return 1;
+    }
+    int target_frame = frame_list[0];
     float r_coeff = std::stof(argv[3]);
     float g_coeff = std::stof(argv[4]);
     float b_coeff = std::stof(argv[5]);
 
     std::cout << "Arguments parsed successfully" << std::endl;
 
+    // Several frames: extract them all in one pass and write files, no viewer
+    if (frame_list.size() > 1) {
+        FrameExtractor extractor;
+        std::cout << "Extracting " << frame_list.size() << " frames..." << std::endl;
+        int written = extractor.extract_frame_list(filename, frame_list, r_coeff, g_coeff, b_coeff);
+        std::cout << "Wrote " << written << " of " << frame_list.size() << " frames" << std::endl;
+        return written > 0 ? 0 : 1;
+    }
+
     // To extract frames into memory
     FrameExtractor extractor;
     std::cout << "Starting frame extraction..." << std::endl;
@@ -432,7 +1250,7 @@ int main(int argc, char* argv[]) {
     try {
         std::cout << "Setting up window creation..." << std::endl;
         
-        auto window = new FrameViewer(frames);
+        auto window = new FrameViewer(std::move(frames));
         app->signal_activate().connect([app, window]() {
             std::cout << "Activation signal received..." << std::endl;
             app->add_window(*window);
@@ -453,9 +1271,20 @@ int main(int argc, char* argv[]) {
 
 
 // Compile with:
-// g++ -o A6 A6.cpp `pkg-config --cflags --libs gtkmm-4.0` -lavformat -lavcodec -lavutil -lswscale
+// g++ -o A6 A6.cpp `pkg-config --cflags --libs gtkmm-4.0` -lavformat -lavcodec -lavutil -lswscale -pthread
+// (add -O2 -mavx2 to build the AVX2 gray kernel, or -mssse3 for the SSSE3 one; scalar otherwise)
 
 // Run with:
 // ./A6 <video_file> <frame_number> <r_coeff> <g_coeff> <b_coeff>
 // Example: ./A6 1.mp4 10 0.299 0.587 0.114
-// Another example: ./A6 2.mp4 100 0.2126 0.7152 0.0722
\ No newline at end of file
+// Another example: ./A6 2.mp4 100 0.2126 0.7152 0.0722
+
+// Several frames at once (written as frame_<n>_color.ppm / frame_<n>_gray.pgm, no window):
+// ./A6 1.mp4 10,250,900 0.299 0.587 0.114
+// ./A6 1.mp4 0-3000:100 0.299 0.587 0.114
+
+// Gray conversion benchmark at 4K, float loop vs fixed-point kernels:
+// ./A6 --bench-gray
+
+// Contact sheet of evenly spaced frames (keyframes unless --exact), thumbnails 320 wide by default:
+// ./A6 --contact-sheet 1.mp4 24 sheet.png [thumb_width] [--exact]
\ No newline at end of file
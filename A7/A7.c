@@ -188,6 +188,31 @@ int buffer_pop(FrameData *frame) {
 }
 
 
+/**
+* Converts a decoded frame into the destination buffers at the given size
+* The scaler comes from sws_getCachedContext, so it is only rebuilt when the
+* frame's pixel format or size changes instead of being fixed up front from
+* codec_context->pix_fmt (which can be unset before the first frame)
+* Returns 1 if successful, 0 if no scaler could be created
+*/
+int convert_frame(struct SwsContext **ctx, const AVFrame *src,
+                enum AVPixelFormat dst_format, int dst_width, int dst_height,
+                uint8_t *const dst_data[4], const int dst_linesize[4]) {
+    *ctx = sws_getCachedContext(*ctx,
+                                src->width, src->height, (enum AVPixelFormat)src->format,
+                                dst_width, dst_height, dst_format,
+                                SWS_BILINEAR, NULL, NULL, NULL);
+    
+    if (*ctx == NULL) {
+        return 0;
+    }
+    
+    sws_scale(*ctx, (const uint8_t * const*)src->data, src->linesize,
+            0, src->height, dst_data, dst_linesize);
+    return 1;
+}
+
+
 // Initializes FFmpeg and open video file
 int init_ffmpeg(const char *filename) {
     // Initializes FFmpeg
@@ -265,6 +290,7 @@ void cleanup_ffmpeg() {
     
     if (sws_context) {
         sws_freeContext(sws_context);
+        sws_context = NULL;
     }
 }
 
@@ -294,16 +320,6 @@ void *decode_thread(void *arg) {
                         rgb_buffer, AV_PIX_FMT_RGB24, 
                         codec_context->width, codec_context->height, 1);
     
-    // Initializes software scaler
-    sws_context = sws_getContext(codec_context->width, codec_context->height, codec_context->pix_fmt,
-                                codec_context->width, codec_context->height, AV_PIX_FMT_RGB24,
-                                SWS_BILINEAR, NULL, NULL, NULL);
-    
-    if (!sws_context) {
-        fprintf(stderr, "Could not initialize the conversion context\n");
-        return NULL;
-    }
-    
     // Reads frames
     while (running && av_read_frame(format_context, packet) >= 0) {
         if (packet->stream_index == video_stream_index) {
@@ -326,8 +342,13 @@ void *decode_thread(void *arg) {
                 }
                 
                 // Convert to RGB
-                sws_scale(sws_context, (const uint8_t * const*)frame->data, frame->linesize,
-                        0, codec_context->height, rgb_frame->data, rgb_frame->linesize);
+                if (!convert_frame(&sws_context, frame, AV_PIX_FMT_RGB24,
+                                codec_context->width, codec_context->height,
+                                rgb_frame->data, rgb_frame->linesize)) {
+                    fprintf(stderr, "Could not initialize the conversion context\n");
+                    running = 0;
+                    break;
+                }
                 
                 // Add to buffer
                 buffer_push(rgb_frame->data[0], codec_context->width, codec_context->height, rgb_frame->linesize[0]);
@@ -350,8 +371,12 @@ void *decode_thread(void *arg) {
         }
         
         // Convert to RGB
-        sws_scale(sws_context, (const uint8_t * const*)frame->data, frame->linesize,
-                0, codec_context->height, rgb_frame->data, rgb_frame->linesize);
+        if (!convert_frame(&sws_context, frame, AV_PIX_FMT_RGB24,
+                        codec_context->width, codec_context->height,
+                        rgb_frame->data, rgb_frame->linesize)) {
+            fprintf(stderr, "Could not initialize the conversion context\n");
+            break;
+        }
         
         // Add to buffer
         buffer_push(rgb_frame->data[0], codec_context->width, codec_context->height, rgb_frame->linesize[0]);